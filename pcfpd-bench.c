@@ -0,0 +1,960 @@
+/*
+ * Copyright (C) 2013 Alexander J. Iadicicco
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Open-loop load generator for pcfpd. Connections are started on a
+ * fixed schedule (evenly spaced or Poisson) that does not wait for the
+ * server, and each one's latency runs from when it was *supposed* to
+ * start until the whole policy has arrived. If the generator falls
+ * behind because the server is slow, the delay still counts against
+ * the server instead of quietly lowering the offered load.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <math.h>
+
+#define DEFAULT_PORT 843
+#define DEFAULT_SECS 10
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEFAULT_MAX_CONNS 10000
+#define DEFAULT_KNEE 10.0
+#define DEFAULT_SAMPLE_SECS 60
+
+static const char request[] = "<policy-file-request/>";
+
+/*
+ * Log-linear histogram of microseconds: values under 16 get their own
+ * bucket, above that each power of two is split into 16, so a reported
+ * percentile is within about 6% of the real one.
+ */
+
+#define HIST_SUB 16
+#define HIST_BUCKETS ((40 - 3) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+static int hist_index(uint64_t v)
+{
+	int e, i;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	i = (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+
+	return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/* largest value that lands in bucket i */
+static uint64_t hist_value(int i)
+{
+	int e;
+
+	if (i < HIST_SUB)
+		return i;
+
+	e = i / HIST_SUB + 3;
+	return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - 4)) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count++;
+	h->bucket[hist_index(v)]++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static uint64_t hist_quantile(const struct hist *h, double q)
+{
+	uint64_t want = ceil(q * h->count), seen = 0;
+	int i;
+
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+
+	if (i == HIST_BUCKETS || hist_value(i) > h->max)
+		return h->max;
+
+	return hist_value(i);
+}
+
+struct conn {
+	int fd;
+	int sent;
+	size_t got;
+	uint64_t intended;
+	struct conn *next_free;
+};
+
+struct result {
+	double rate;
+	double planned;
+	double secs;
+	uint64_t started;
+	uint64_t done;
+	uint64_t errors;
+	uint64_t timeouts;
+	struct hist lat;
+};
+
+static struct sockaddr_in target;
+static int poisson;
+static int timeout_ms = DEFAULT_TIMEOUT_MS;
+static int max_conns = DEFAULT_MAX_CONNS;
+static long expect_len;
+static int running = 1;
+
+/* called every sample_secs during run(), and once at the end, when set */
+static void (*sampler)(const struct result *res, double elapsed);
+static double sample_secs;
+
+static struct conn *conns;
+static struct conn *free_conns;
+static int active;
+static int epfd;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_gap(double rate)
+{
+	double u;
+
+	if (!poisson)
+		return 1e9 / rate;
+
+	/* exponential inter-arrival times give a Poisson process */
+	u = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+	return -log(u) * 1e9 / rate;
+}
+
+static void conn_close(struct conn *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->next_free = free_conns;
+	free_conns = c;
+	active--;
+}
+
+static int conn_start(struct conn *c, uint64_t intended)
+{
+	struct epoll_event ev;
+
+	if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+
+	if (connect(c->fd, (struct sockaddr*)&target, sizeof(target)) < 0 &&
+	    errno != EINPROGRESS) {
+		close(c->fd);
+		return -1;
+	}
+
+	c->sent = 0;
+	c->got = 0;
+	c->intended = intended;
+
+	ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+		close(c->fd);
+		return -1;
+	}
+
+	active++;
+	return 0;
+}
+
+/* returns 1 when the connection is finished, 0 to keep waiting */
+static int conn_event(struct conn *c, uint32_t events, struct result *res)
+{
+	char buf[4096];
+	struct epoll_event ev;
+	ssize_t sz;
+	int err;
+	socklen_t len = sizeof(err);
+
+	if (!c->sent && (events & (EPOLLOUT | EPOLLERR))) {
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err ||
+		    write(c->fd, request, sizeof(request)) != sizeof(request)) {
+			res->errors++;
+			return 1;
+		}
+		c->sent = 1;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+
+	if (!c->sent || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		return 0;
+
+	for (;;) {
+		sz = read(c->fd, buf, sizeof(buf));
+		if (sz > 0) {
+			c->got += sz;
+			continue;
+		}
+		if (sz < 0 && errno == EAGAIN)
+			return 0;
+		break;
+	}
+
+	/*
+	 * pcfpd never reads the request, so its close may turn into a reset;
+	 * that is still a delivered policy as long as the data came first.
+	 * A close before any (or, with -L, all) of the policy is a failure:
+	 * a refused or crashed connection must not look like a fast one.
+	 */
+	if ((sz < 0 && errno != ECONNRESET) || c->got == 0 ||
+	    c->got < (size_t)expect_len) {
+		res->errors++;
+		return 1;
+	}
+
+	res->done++;
+	hist_add(&res->lat, (now_ns() - c->intended) / 1000);
+	return 1;
+}
+
+static void expire(uint64_t now, struct result *res)
+{
+	int i;
+
+	for (i = 0; i < max_conns; i++) {
+		if (conns[i].fd >= 0 &&
+		    now - conns[i].intended > (uint64_t)timeout_ms * 1000000) {
+			res->timeouts++;
+			conn_close(&conns[i]);
+		}
+	}
+}
+
+/*
+ * Offers load at rate connections per second for secs seconds, then
+ * waits for whatever is still outstanding. Attempts that cannot start
+ * because max_conns are open stay queued with their original start
+ * time rather than being dropped.
+ */
+static void run(double rate, double secs, struct result *res)
+{
+	struct epoll_event evs[256];
+	uint64_t start, end, next, now, last_expire, next_sample, last_sample;
+	int i, n, wait_ms;
+
+	memset(res, 0, sizeof(*res));
+	res->rate = rate;
+	res->planned = secs;
+
+	start = now = last_expire = now_ns();
+	end = start + secs * 1e9;
+	next = start;
+	next_sample = start + sample_secs * 1e9;
+	last_sample = start;
+
+	while (running && (next < end || active)) {
+		while (next < end && next <= now && free_conns) {
+			struct conn *c = free_conns;
+
+			free_conns = c->next_free;
+			res->started++;
+			if (conn_start(c, next) < 0) {
+				res->errors++;
+				c->fd = -1;
+				c->next_free = free_conns;
+				free_conns = c;
+			}
+			next += next_gap(rate);
+		}
+
+		if (next < end && free_conns)
+			wait_ms = next > now ? (next - now + 999999) / 1000000 : 0;
+		else
+			wait_ms = 100;
+
+		n = epoll_wait(epfd, evs, 256, wait_ms);
+		for (i = 0; i < n; i++) {
+			struct conn *c = evs[i].data.ptr;
+
+			if (conn_event(c, evs[i].events, res))
+				conn_close(c);
+		}
+
+		now = now_ns();
+		if (now - last_expire > 100000000) {
+			expire(now, res);
+			last_expire = now;
+		}
+
+		/* the interval that ends with the run is sampled below instead */
+		if (sampler && now >= next_sample && next_sample < end) {
+			res->secs = (now - start) / 1e9;
+			sampler(res, res->secs);
+			next_sample += sample_secs * 1e9;
+			last_sample = now;
+		}
+	}
+
+	now = now_ns();
+	res->secs = (now - start) / 1e9;
+	if (sampler && now > last_sample)
+		sampler(res, res->secs);
+}
+
+static void print_header(void)
+{
+	printf("%10s %10s %9s %7s %7s %9s %9s %9s %9s %9s\n", "target/s",
+	       "done/s", "done", "errors", "tmouts", "p50 us", "p90 us",
+	       "p99 us", "p99.9 us", "max us");
+}
+
+static void print_result(const struct result *r)
+{
+	printf("%10.0f %10.0f %9llu %7llu %7llu %9llu %9llu %9llu %9llu %9llu\n",
+	       r->rate, r->done / r->secs, (unsigned long long)r->done,
+	       (unsigned long long)r->errors, (unsigned long long)r->timeouts,
+	       (unsigned long long)hist_quantile(&r->lat, 0.5),
+	       (unsigned long long)hist_quantile(&r->lat, 0.9),
+	       (unsigned long long)hist_quantile(&r->lat, 0.99),
+	       (unsigned long long)hist_quantile(&r->lat, 0.999),
+	       (unsigned long long)r->lat.max);
+	fflush(stdout);
+}
+
+/*
+ * A step is past the knee once it cannot keep up with the offered load,
+ * loses more than 1% of attempts, or its p99 has grown by knee times
+ * over the first step's.
+ */
+static int past_knee(const struct result *r, uint64_t base_p99, double knee)
+{
+	uint64_t failed = r->errors + r->timeouts;
+
+	if (r->done < 0.95 * r->rate * r->planned)
+		return 1;
+	if (failed * 100 > r->started)
+		return 1;
+	return base_p99 && hist_quantile(&r->lat, 0.99) > knee * base_p99;
+}
+
+/*
+ * Soak mode (-S): hold one rate for hours and watch the server for slow
+ * leaks. Every sample_secs it records the latency of that interval and,
+ * given the server's PID, the summed RSS, open fds, processes, threads
+ * and zombies of its whole process tree (workers and connection
+ * children included). At the end any series that keeps rising is
+ * flagged.
+ *
+ * Scanning /proc can take long enough on a busy box to delay the
+ * connection schedule, so run() only hands a copy of its totals to a
+ * sampling thread, which does the scan and the printing.
+ */
+
+#define MAX_TREE 65536
+
+enum {
+	M_P99,
+	M_RSS,
+	M_FDS,
+	M_PROCS,
+	M_THREADS,
+	M_ZOMBIES,
+	N_METRICS
+};
+
+static const char *metric_names[N_METRICS] = {
+	"p99 us", "rss kB", "fds", "procs", "threads", "zombies"
+};
+
+/* growth below both of these is noise, not a leak */
+static const double metric_min_abs[N_METRICS] = { 0, 1024, 4, 4, 4, 1 };
+static const double metric_min_rel[N_METRICS] = { 0.5, 0.1, 0.1, 0.1, 0.1, 0 };
+
+static pid_t soak_pid;
+static double (*samples)[N_METRICS];
+static size_t n_samples, samples_size;
+static struct result soak_last;
+static double soak_last_secs;
+
+static pthread_t soak_thread;
+static pthread_mutex_t soak_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t soak_wake = PTHREAD_COND_INITIALIZER;
+static struct result soak_pending;
+static int soak_queued, soak_stop;
+
+static long count_fds(pid_t pid)
+{
+	char path[64];
+	DIR *d;
+	struct dirent *de;
+	long n = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+	if (!(d = opendir(path)))
+		return 0;
+	while ((de = readdir(d)))
+		if (de->d_name[0] != '.')
+			n++;
+	closedir(d);
+
+	return n;
+}
+
+static void read_status(pid_t pid, long *rss_kb, long *threads)
+{
+	char path[64], line[256];
+	FILE *f;
+
+	*rss_kb = *threads = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if (!(f = fopen(path, "r")))
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "VmRSS: %ld", rss_kb);
+		sscanf(line, "Threads: %ld", threads);
+	}
+	fclose(f);
+}
+
+/* fills pids, ppids and states for every process; returns the count */
+static size_t scan_procs(pid_t *pids, pid_t *ppids, char *states)
+{
+	char path[64], buf[512], *p;
+	DIR *d;
+	struct dirent *de;
+	FILE *f;
+	size_t n = 0;
+
+	if (!(d = opendir("/proc")))
+		return 0;
+
+	while (n < MAX_TREE && (de = readdir(d))) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", atoi(de->d_name));
+		if (!(f = fopen(path, "r")))
+			continue;
+		p = fgets(buf, sizeof(buf), f);
+		fclose(f);
+		/* the command name may contain anything, so parse after it */
+		if (!p || !(p = strrchr(buf, ')')))
+			continue;
+		if (sscanf(p + 1, " %c %d", &states[n], &ppids[n]) != 2)
+			continue;
+		pids[n++] = atoi(de->d_name);
+	}
+	closedir(d);
+
+	return n;
+}
+
+static void sample_tree(double *m)
+{
+	static pid_t pids[MAX_TREE], ppids[MAX_TREE];
+	static char states[MAX_TREE], in_tree[MAX_TREE];
+	size_t n, i, j, grew;
+	long rss, threads;
+
+	n = scan_procs(pids, ppids, states);
+
+	memset(in_tree, 0, n);
+	for (i = 0; i < n; i++)
+		in_tree[i] = pids[i] == soak_pid;
+
+	/* parents may be listed after their children, so repeat until stable */
+	do {
+		grew = 0;
+		for (i = 0; i < n; i++) {
+			if (in_tree[i])
+				continue;
+			for (j = 0; j < n; j++) {
+				if (in_tree[j] && pids[j] == ppids[i]) {
+					in_tree[i] = 1;
+					grew = 1;
+					break;
+				}
+			}
+		}
+	} while (grew);
+
+	for (i = 0; i < n; i++) {
+		if (!in_tree[i])
+			continue;
+		m[M_PROCS]++;
+		if (states[i] == 'Z') {
+			m[M_ZOMBIES]++;
+			continue;
+		}
+		read_status(pids[i], &rss, &threads);
+		m[M_RSS] += rss;
+		m[M_THREADS] += threads;
+		m[M_FDS] += count_fds(pids[i]);
+	}
+}
+
+/* runs on the sampling thread; res->secs is when it was taken */
+static void soak_record(const struct result *res)
+{
+	struct result *win = &soak_last;
+	double *m, elapsed = res->secs, len = elapsed - soak_last_secs;
+	int i;
+
+	if (n_samples == samples_size) {
+		samples_size = samples_size ? samples_size * 2 : 256;
+		samples = realloc(samples, samples_size * sizeof(*samples));
+		if (!samples) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	m = samples[n_samples++];
+	memset(m, 0, sizeof(*samples));
+
+	/* this interval only: the running totals minus the previous ones */
+	for (i = 0; i < HIST_BUCKETS; i++)
+		win->lat.bucket[i] = res->lat.bucket[i] - win->lat.bucket[i];
+	win->lat.count = res->lat.count - win->lat.count;
+	win->lat.max = res->lat.max;
+	m[M_P99] = win->lat.count ? hist_quantile(&win->lat, 0.99) : 0;
+
+	if (soak_pid)
+		sample_tree(m);
+
+	printf("%9.0f %9.0f %9llu %9llu %6.0f %10.0f %7.0f %7.0f %8.0f %8.0f\n",
+	       elapsed, len > 0 ? win->lat.count / len : 0,
+	       (unsigned long long)(res->errors - win->errors),
+	       (unsigned long long)(res->timeouts - win->timeouts), m[M_P99],
+	       m[M_RSS], m[M_FDS], m[M_PROCS], m[M_THREADS], m[M_ZOMBIES]);
+	fflush(stdout);
+
+	*win = *res;
+	soak_last_secs = elapsed;
+}
+
+static void *soak_worker(void *arg)
+{
+	static struct result res;
+
+	pthread_mutex_lock(&soak_mu);
+	for (;;) {
+		while (!soak_queued && !soak_stop)
+			pthread_cond_wait(&soak_wake, &soak_mu);
+		if (!soak_queued)
+			break;
+		res = soak_pending;
+		soak_queued = 0;
+		pthread_mutex_unlock(&soak_mu);
+
+		soak_record(&res);
+
+		pthread_mutex_lock(&soak_mu);
+	}
+	pthread_mutex_unlock(&soak_mu);
+
+	return NULL;
+}
+
+/*
+ * Called from run(). If the thread is still busy with the previous
+ * sample this one replaces it; the next sample then covers both
+ * intervals, as its latency is taken against the last one recorded.
+ */
+static void soak_sample(const struct result *res, double elapsed)
+{
+	pthread_mutex_lock(&soak_mu);
+	soak_pending = *res;
+	soak_pending.secs = elapsed;
+	soak_queued = 1;
+	pthread_cond_signal(&soak_wake);
+	pthread_mutex_unlock(&soak_mu);
+}
+
+/*
+ * A metric is flagged when it trends upward (Kendall's tau over the
+ * samples above 0.5) and the mean of the last third exceeds the first
+ * third's by more than the metric's noise floor.
+ */
+static int soak_analyze(void)
+{
+	size_t i, j, third = n_samples / 3;
+	double first, last, tau, s, floor;
+	int k, flagged = 0;
+
+	if (n_samples < 6) {
+		printf("too few samples (%zu) to look for trends\n", n_samples);
+		return 0;
+	}
+
+	for (k = 0; k < N_METRICS; k++) {
+		if (k != M_P99 && !soak_pid)
+			continue;
+
+		s = 0;
+		for (i = 0; i < n_samples; i++) {
+			for (j = i + 1; j < n_samples; j++) {
+				if (samples[j][k] > samples[i][k])
+					s++;
+				else if (samples[j][k] < samples[i][k])
+					s--;
+			}
+		}
+		tau = s / (n_samples * (n_samples - 1) / 2.0);
+
+		first = last = 0;
+		for (i = 0; i < third; i++) {
+			first += samples[i][k];
+			last += samples[n_samples - 1 - i][k];
+		}
+		first /= third;
+		last /= third;
+
+		floor = metric_min_rel[k] * first;
+		if (floor < metric_min_abs[k])
+			floor = metric_min_abs[k];
+
+		if (tau > 0.5 && last - first > floor) {
+			printf("FLAG %s: %.0f -> %.0f over the run (tau %.2f)\n",
+			       metric_names[k], first, last, tau);
+			flagged = 1;
+		}
+	}
+
+	if (!flagged)
+		printf("no growth or degradation detected\n");
+
+	return flagged;
+}
+
+static int soak(double rate, double secs, double interval)
+{
+	struct result *res;
+
+	if (!(res = malloc(sizeof(*res)))) {
+		perror("malloc");
+		return 1;
+	}
+
+	if ((errno = pthread_create(&soak_thread, NULL, soak_worker, NULL))) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	sampler = soak_sample;
+	sample_secs = interval;
+
+	printf("%9s %9s %9s %9s %6s %10s %7s %7s %8s %8s\n", "secs", "done/s",
+	       "errors", "tmouts", "p99 us", "rss kB", "fds", "procs", "threads",
+	       "zombies");
+	run(rate, secs, res);
+
+	/* the worker records anything still queued before it exits */
+	pthread_mutex_lock(&soak_mu);
+	soak_stop = 1;
+	pthread_cond_signal(&soak_wake);
+	pthread_mutex_unlock(&soak_mu);
+	pthread_join(soak_thread, NULL);
+
+	return soak_analyze() ? 2 : 0;
+}
+
+/* seconds, with an optional s, m or h suffix */
+static double parse_secs(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	switch (*end) {
+	case 'h':
+		v *= 60;
+		/* fall through */
+	case 'm':
+		v *= 60;
+		/* fall through */
+	case 's':
+		end++;
+	}
+
+	return *end ? -1 : v;
+}
+
+static void sigint_handler(int sig)
+{
+	running = 0;
+}
+
+static int parse_rates(const char *s, double *from, double *to, double *step)
+{
+	int n = sscanf(s, "%lf:%lf:%lf", from, to, step);
+
+	if (n == 1) {
+		*to = *from;
+		*step = 1;
+	} else if (n != 3) {
+		return -1;
+	}
+
+	return *from > 0 && *to >= *from && *step > 0 ? 0 : -1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "\nUsage: %s [OPTIONS] -r RATE[:END:STEP]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, " -r RATE     Offer RATE connections per second; with\n");
+	fprintf(stderr, "             END:STEP, sweep up to END and report the knee\n");
+	fprintf(stderr, " -h HOST     Connect to HOST (default 127.0.0.1)\n");
+	fprintf(stderr, " -p PORT     Connect to PORT (default %d)\n", DEFAULT_PORT);
+	fprintf(stderr, " -t SECS     Run each rate for SECS seconds (default %d)\n",
+	        DEFAULT_SECS);
+	fprintf(stderr, " -P          Poisson arrivals instead of evenly spaced\n");
+	fprintf(stderr, " -c MAX      Keep at most MAX connections open (default %d)\n",
+	        DEFAULT_MAX_CONNS);
+	fprintf(stderr, " -T MS       Give up on a connection after MS ms (default %d)\n",
+	        DEFAULT_TIMEOUT_MS);
+	fprintf(stderr, " -L BYTES    Count a connection as served only once BYTES\n");
+	fprintf(stderr, "             of policy arrived (default: any)\n");
+	fprintf(stderr, " -k FACTOR   Knee when p99 exceeds FACTOR times the first\n");
+	fprintf(stderr, "             rate's p99 (default %.0f)\n", DEFAULT_KNEE);
+	fprintf(stderr, " -S TIME     Soak: hold RATE for TIME (e.g. 6h) and flag\n");
+	fprintf(stderr, "             anything that keeps growing; exits 2 if so\n");
+	fprintf(stderr, " -i TIME     Soak sample interval (default %ds)\n",
+	        DEFAULT_SAMPLE_SECS);
+	fprintf(stderr, " -x PID      Soak: watch pcfpd's process tree at PID\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i;
+	double from = 0, to = 0, step = 0, rate, secs = DEFAULT_SECS;
+	double knee = DEFAULT_KNEE, last_good = 0;
+	double soak_secs = 0, interval = DEFAULT_SAMPLE_SECS;
+	uint64_t base_p99 = 0;
+	const char *host = "127.0.0.1";
+	unsigned short port = DEFAULT_PORT;
+	struct rlimit rl;
+	struct result *res;
+
+	while ((c = getopt(argc, argv, "r:h:p:t:Pc:T:L:k:S:i:x:")) != -1) switch (c) {
+	case 'r':
+		if (parse_rates(optarg, &from, &to, &step) < 0) {
+			fprintf(stderr, "Invalid rate %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'h':
+		host = optarg;
+		break;
+
+	case 'p':
+		port = atoi(optarg);
+		if (port == 0) {
+			fprintf(stderr, "Invalid port %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 't':
+		secs = atof(optarg);
+		if (secs <= 0) {
+			fprintf(stderr, "Invalid duration %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'P':
+		poisson = 1;
+		break;
+
+	case 'c':
+		max_conns = atoi(optarg);
+		if (max_conns < 1) {
+			fprintf(stderr, "Invalid connection limit %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'T':
+		timeout_ms = atoi(optarg);
+		if (timeout_ms < 1) {
+			fprintf(stderr, "Invalid timeout %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'L':
+		expect_len = atol(optarg);
+		if (expect_len < 1) {
+			fprintf(stderr, "Invalid policy length %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'k':
+		knee = atof(optarg);
+		if (knee <= 1) {
+			fprintf(stderr, "Invalid knee factor %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'S':
+		soak_secs = parse_secs(optarg);
+		if (soak_secs <= 0) {
+			fprintf(stderr, "Invalid soak time %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'i':
+		interval = parse_secs(optarg);
+		if (interval <= 0) {
+			fprintf(stderr, "Invalid sample interval %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'x':
+		soak_pid = atoi(optarg);
+		if (soak_pid <= 0) {
+			fprintf(stderr, "Invalid PID %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	default:
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (from <= 0) {
+		fprintf(stderr, "Missing required rate argument -r\n");
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+		fprintf(stderr, "Invalid host %s\n", host);
+		return 1;
+	}
+
+	/* every open connection is an fd */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur != RLIM_INFINITY && max_conns > rl.rlim_cur - 16)
+			max_conns = rl.rlim_cur - 16;
+	}
+
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	conns = calloc(max_conns, sizeof(*conns));
+	res = malloc(sizeof(*res));
+	if (!conns || !res) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = max_conns - 1; i >= 0; i--) {
+		conns[i].fd = -1;
+		conns[i].next_free = free_conns;
+		free_conns = &conns[i];
+	}
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGPIPE, SIG_IGN);
+	srandom(now_ns());
+
+	if (soak_secs) {
+		if (from != to) {
+			fprintf(stderr, "Soak mode takes a single rate\n");
+			return 1;
+		}
+		return soak(from, soak_secs, interval);
+	}
+
+	print_header();
+	for (rate = from; running && rate <= to + step / 2; rate += step) {
+		run(rate, secs, res);
+		print_result(res);
+
+		if (!base_p99)
+			base_p99 = hist_quantile(&res->lat, 0.99);
+
+		if (from == to)
+			break;
+
+		if (past_knee(res, base_p99, knee)) {
+			if (last_good)
+				printf("knee: between %.0f and %.0f connections/s\n",
+				       last_good, rate);
+			else
+				printf("knee: below %.0f connections/s\n", rate);
+			return 0;
+		}
+		last_good = rate;
+	}
+
+	if (from != to && running)
+		printf("knee: not reached by %.0f connections/s\n", last_good);
+
+	return 0;
+}
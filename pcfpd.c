@@ -25,124 +25,1706 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <time.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <math.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 
 #define DEFAULT_PORT 843
 #define MAX_POLICY_LEN 65536
+#define MAX_WORKERS 64
+
+#ifndef IP_TRANSPARENT
+#define IP_TRANSPARENT 19
+#endif
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80
+#endif
 
 /* TODO: fflush in exit handler */
 
-static FILE *log_f;
+static FILE *log_f;
+
+/*
+ * With -z the log is a series of gzip members instead: lines go into a
+ * queue, and a thread in each process deflates them and appends a
+ * finished member with a single write() every LOG_MEMBER_SECS or
+ * LOG_MEMBER_BYTES. Members decompress independently, so the file can
+ * be read with zcat, followed with tail, and cut at any member boundary.
+ * Until log_start() the lines are deflated inline instead, so nothing
+ * is left queued across a fork.
+ */
+
+#define LOG_MEMBER_SECS 10
+#define LOG_MEMBER_BYTES (1 << 20)
+#define LOG_QUEUE (256 * 1024)
+
+static int log_gz;
+static int log_fd = -1;
+static z_stream log_zs;
+static unsigned char *log_out;
+static size_t log_out_size;
+static size_t log_member_in;
+static time_t log_member_start;
+
+static char log_queue[LOG_QUEUE];
+static size_t log_queued;
+static int log_threaded;
+static int log_stopping;
+static pthread_t log_thread;
+static pthread_mutex_t log_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_space = PTHREAD_COND_INITIALIZER;
+
+static const char *log_prefix(void)
+{
+	static char pfx[512];
+	time_t now;
+	struct tm *tmp;
+	size_t sz;
+
+	now = time(NULL);
+	if (!(tmp = localtime(&now)))
+		sz = snprintf(pfx, 512, "[----/--/-- --:--:-- +----] ");
+	else
+		sz = strftime(pfx, 512, "[%Y/%m/%d %H:%M:%S %z] ", tmp);
+
+	return pfx;
+}
+
+static void log_finish(void)
+{
+	size_t len, off;
+	ssize_t sz;
+
+	if (log_member_in == 0)
+		return;
+
+	deflate(&log_zs, Z_FINISH);
+	len = log_zs.next_out - log_out;
+
+	for (off = 0; off < len; off += sz) {
+		if ((sz = write(log_fd, log_out + off, len - off)) <= 0)
+			break;
+	}
+
+	deflateReset(&log_zs);
+	log_zs.next_out = log_out;
+	log_zs.avail_out = log_out_size;
+	log_member_in = 0;
+}
+
+static void log_deflate(const char *buf, size_t len)
+{
+	if (len) {
+		if (log_member_in == 0)
+			log_member_start = time(NULL);
+		log_zs.next_in = (unsigned char*)buf;
+		log_zs.avail_in = len;
+		deflate(&log_zs, Z_NO_FLUSH);
+		log_member_in += len;
+	}
+
+	if (log_member_in >= LOG_MEMBER_BYTES ||
+	    (log_member_in && time(NULL) - log_member_start >= LOG_MEMBER_SECS))
+		log_finish();
+}
+
+static void *log_worker(void *arg)
+{
+	static char chunk[LOG_QUEUE];
+	struct timespec until;
+	size_t len;
+	int stop;
+
+	pthread_mutex_lock(&log_mu);
+	for (;;) {
+		while (!log_queued && !log_stopping) {
+			if (!log_member_in) {
+				pthread_cond_wait(&log_wake, &log_mu);
+				continue;
+			}
+			until.tv_sec = log_member_start + LOG_MEMBER_SECS;
+			until.tv_nsec = 0;
+			if (pthread_cond_timedwait(&log_wake, &log_mu, &until))
+				break;
+		}
+
+		len = log_queued;
+		memcpy(chunk, log_queue, len);
+		log_queued = 0;
+		stop = log_stopping;
+		pthread_cond_broadcast(&log_space);
+		pthread_mutex_unlock(&log_mu);
+
+		log_deflate(chunk, len);
+		if (stop) {
+			log_finish();
+			return NULL;
+		}
+
+		pthread_mutex_lock(&log_mu);
+	}
+}
+
+static void log_put(const char *buf, size_t len)
+{
+	if (!log_threaded) {
+		log_deflate(buf, len);
+		return;
+	}
+
+	if (len > LOG_QUEUE)
+		len = LOG_QUEUE;
+
+	pthread_mutex_lock(&log_mu);
+	while (LOG_QUEUE - log_queued < len)
+		pthread_cond_wait(&log_space, &log_mu);
+	memcpy(log_queue + log_queued, buf, len);
+	log_queued += len;
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_mu);
+}
+
+static void log_line(const char *fmt, ...)
+{
+	char buf[4096];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buf, 4096, fmt, va);
+	va_end(va);
+
+	if (log_gz) {
+		char line[4608];
+		int len;
+
+		len = snprintf(line, sizeof(line), "%s%s\n", log_prefix(), buf);
+		if (len >= sizeof(line))
+			len = sizeof(line) - 1;
+		log_put(line, len);
+		return;
+	}
+
+	fprintf(log_f, "%s%s\n", log_prefix(), buf);
+}
+
+static void log_flush(void)
+{
+	if (log_gz) {
+		if (!log_threaded)
+			log_finish();
+		return;
+	}
+
+	fflush(log_f);
+}
+
+static int log_open_gz(const char *filename)
+{
+	if ((log_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		return -1;
+
+	/* 16 + MAX_WBITS asks for a gzip header and trailer */
+	if (deflateInit2(&log_zs, 1, Z_DEFLATED, 16 + MAX_WBITS, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		close(log_fd);
+		log_fd = -1;
+		return -1;
+	}
+
+	log_out_size = deflateBound(&log_zs, LOG_MEMBER_BYTES + LOG_QUEUE);
+	if (!(log_out = malloc(log_out_size))) {
+		deflateEnd(&log_zs);
+		close(log_fd);
+		log_fd = -1;
+		return -1;
+	}
+	log_zs.next_out = log_out;
+	log_zs.avail_out = log_out_size;
+
+	return 0;
+}
+
+static void log_open(const char *filename)
+{
+	if (log_f != NULL || log_fd >= 0) {
+		log_line("tried to open log again");
+		return;
+	}
+
+	if (log_gz) {
+		if (filename && log_open_gz(filename) == 0) {
+			log_line("pcfpd started");
+			return;
+		}
+		fprintf(stderr, "Could not open compressed log %s; using stdout\n",
+		        filename ? filename : "(none)");
+		log_gz = 0;
+	}
+
+	log_f = stdout;
+
+	if (filename) {
+		log_f = fopen(filename, "a");
+
+		if (!log_f) {
+			fprintf(stderr, "Could not open log file %s; using stdout\n",
+			        filename);
+			log_f = stdout;
+		}
+	}
+
+	/*
+	 * Workers share this stream; line buffered, every line leaves in one
+	 * write() on the O_APPEND file, so lines from different workers
+	 * cannot interleave. Must happen before anything is written.
+	 */
+	setvbuf(log_f, NULL, _IOLBF, 0);
+
+	log_line("pcfpd started");
+}
+
+/* hands compression to a thread; call after the last fork that keeps logging */
+static void log_start(void)
+{
+	if (!log_gz)
+		return;
+
+	if (pthread_create(&log_thread, NULL, log_worker, NULL) == 0)
+		log_threaded = 1;
+}
+
+static void log_close(void)
+{
+	if (!log_gz) {
+		fclose(log_f);
+		return;
+	}
+
+	if (log_threaded) {
+		pthread_mutex_lock(&log_mu);
+		log_stopping = 1;
+		pthread_cond_signal(&log_wake);
+		pthread_mutex_unlock(&log_mu);
+		pthread_join(log_thread, NULL);
+		log_threaded = 0;
+	}
+
+	log_finish();
+	deflateEnd(&log_zs);
+	close(log_fd);
+}
+
+static void log_client(struct sockaddr_in *sa, struct sockaddr_in *dst)
+{
+	char buf[256], dbuf[256];
+
+	if (!log_f && log_fd < 0)
+		return;
+
+	inet_ntop(AF_INET, &sa->sin_addr, buf, 256);
+
+	if (!dst) {
+		log_line("%s", buf);
+		return;
+	}
+
+	inet_ntop(AF_INET, &dst->sin_addr, dbuf, 256);
+	log_line("%s -> %s:%u", buf, dbuf, ntohs(dst->sin_port));
+}
+
+static void log_refused(struct sockaddr_in *sa)
+{
+	char buf[256];
+
+	if (!log_f && log_fd < 0)
+		return;
+
+	inet_ntop(AF_INET, &sa->sin_addr, buf, 256);
+
+	log_line("%s refused: over limit", buf);
+}
+
+static void log_errno(const char *msg, int e)
+{
+	log_line("%s: %s", msg, strerror(e));
+}
+
+static char policy_data[MAX_POLICY_LEN];
+static size_t policy_len;
+
+static int read_policy(const char *file)
+{
+	int f;
+	ssize_t sz;
+
+	if ((f = open(file, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	policy_len = 0;
+
+	while (policy_len < MAX_POLICY_LEN) {
+		sz = read(f, policy_data + policy_len, 65536 - policy_len);
+		if (sz < 0) {
+			perror("read");
+			return -1;
+		}
+		if (sz == 0)
+			break;
+		policy_len += sz;
+	}
+
+	return 0;
+}
+
+static void *shm_alloc(size_t sz)
+{
+	void *p;
+
+	p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	         -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return p;
+}
+
+static uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+/*
+ * Per-source limits. The table is an anonymous shared mapping created
+ * before any fork, so every worker and every connection child updates
+ * the same counters. Each slot is one 64-bit word changed only by
+ * compare-and-swap:
+ *
+ *   63..32  source address, host order (0 = never used)
+ *   31..22  connections accepted during the current window
+ *   21..12  connections currently being served
+ *   11..0   window (monotonic seconds, mod 4096)
+ *
+ * A slot may be handed to another address only when its state is the
+ * same as a fresh entry's (nothing active, window expired), and the
+ * handover is itself a single CAS, so an address never loses counts
+ * it is still being limited by. Since the window wraps, an idle slot's
+ * count would come back to life 4096 seconds later; rl_sweep() clears
+ * such slots well before that.
+ */
+
+#define RL_SLOTS 65536
+#define RL_PROBE 32
+#define RL_MAX 1023
+#define RL_SWEEP_SECS 60
+
+#define RL_ADDR(w)   ((uint32_t)((w) >> 32))
+#define RL_COUNT(w)  ((unsigned)((w) >> 22) & 0x3ff)
+#define RL_ACTIVE(w) ((unsigned)((w) >> 12) & 0x3ff)
+#define RL_WIN(w)    ((unsigned)(w) & 0xfff)
+#define RL_WORD(a, c, n, win) \
+	(((uint64_t)(a) << 32) | ((uint64_t)(c) << 22) | \
+	 ((uint64_t)(n) << 12) | (uint64_t)(win))
+
+static uint64_t *rl_table;
+static unsigned rl_rate;
+static unsigned rl_conc;
+
+static unsigned rl_window(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec & 0xfff;
+}
+
+static int rl_init(void)
+{
+	if (!rl_rate && !rl_conc)
+		return 0;
+
+	rl_table = shm_alloc(RL_SLOTS * sizeof(*rl_table));
+	return rl_table ? 0 : -1;
+}
+
+/* returns NULL if every slot in addr's probe sequence is in use */
+static uint64_t *rl_slot(uint32_t addr, unsigned win)
+{
+	uint32_t h = hash32(addr);
+	uint64_t *s, w;
+	int i;
+
+again:
+	for (i = 0; i < RL_PROBE; i++) {
+		s = &rl_table[(h + i) & (RL_SLOTS - 1)];
+		if (RL_ADDR(__atomic_load_n(s, __ATOMIC_ACQUIRE)) == addr)
+			return s;
+	}
+
+	for (i = 0; i < RL_PROBE; i++) {
+		s = &rl_table[(h + i) & (RL_SLOTS - 1)];
+		w = __atomic_load_n(s, __ATOMIC_ACQUIRE);
+		/* another worker may have inserted addr since the first pass */
+		if (RL_ADDR(w) == addr)
+			return s;
+		if (RL_ADDR(w) != 0 && (RL_ACTIVE(w) != 0 || RL_WIN(w) == win))
+			continue;
+		if (__atomic_compare_exchange_n(s, &w, RL_WORD(addr, 0, 0, win),
+		                                0, __ATOMIC_ACQ_REL,
+		                                __ATOMIC_ACQUIRE))
+			return s;
+		/* someone else got there first; they may have inserted addr */
+		goto again;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns -1 if addr is over a limit, 1 if the connection was counted
+ * in *slot (which must be passed to rl_release once it is finished), or
+ * 0 if it was let through untracked because limits are off or the table
+ * is full.
+ */
+static int rl_acquire(uint32_t addr, uint64_t **slot)
+{
+	unsigned win, count, active;
+	uint64_t *s, w;
+
+	if (!rl_table)
+		return 0;
+
+	win = rl_window();
+
+retry:
+	if (!(s = rl_slot(addr, win)))
+		return 0;
+
+	w = __atomic_load_n(s, __ATOMIC_ACQUIRE);
+	do {
+		if (RL_ADDR(w) != addr)
+			goto retry;
+		count = RL_WIN(w) == win ? RL_COUNT(w) : 0;
+		active = RL_ACTIVE(w);
+		if (rl_rate && count >= rl_rate)
+			return -1;
+		if ((rl_conc && active >= rl_conc) || active >= RL_MAX)
+			return -1;
+		if (count < RL_MAX)
+			count++;
+	} while (!__atomic_compare_exchange_n(s, &w,
+	                                      RL_WORD(addr, count, active + 1, win),
+	                                      0, __ATOMIC_ACQ_REL,
+	                                      __ATOMIC_ACQUIRE));
+
+	*slot = s;
+	return 1;
+}
+
+/* a slot with active connections is never reassigned, so this is safe */
+static void rl_release(uint64_t *slot)
+{
+	__atomic_fetch_sub(slot, (uint64_t)1 << 12, __ATOMIC_ACQ_REL);
+}
+
+/* frees idle slots from past windows before their window number recurs */
+static void rl_sweep(void)
+{
+	static struct timespec last;
+	struct timespec ts;
+	unsigned win;
+	uint64_t w;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (ts.tv_sec - last.tv_sec < RL_SWEEP_SECS)
+		return;
+	last = ts;
+
+	win = ts.tv_sec & 0xfff;
+	for (i = 0; i < RL_SLOTS; i++) {
+		w = __atomic_load_n(&rl_table[i], __ATOMIC_ACQUIRE);
+		if (RL_ADDR(w) == 0 || RL_ACTIVE(w) != 0 || RL_WIN(w) == win)
+			continue;
+		/* fails harmlessly if the slot was used in the meantime */
+		__atomic_compare_exchange_n(&rl_table[i], &w, 0, 0, __ATOMIC_ACQ_REL,
+		                            __ATOMIC_ACQUIRE);
+	}
+}
+
+/*
+ * Cluster-wide /24 limits. Every node counts its own accepts per prefix
+ * in a shared table like the per-address one, and the main process
+ * sends the counts its peers have not seen yet, plus any bans it has
+ * decided on, over UDP every CL_INTERVAL_MS. Accepts only ever look at
+ * the local table; peers' contributions are folded into it as they
+ * arrive.
+ *
+ * Counters are kept for the current and the previous wall-clock second,
+ * so nodes agree on windows as long as their clocks do, and the limit
+ * is checked against a sliding one-second estimate over both. Counts
+ * for the previous second are still sent and accepted, so accepts made
+ * after the last flush of a second, and packets that cross the second
+ * boundary, are not lost. A packet is
+ *
+ *   "PCS" version(1) window(u32) sequence(u64), both big endian
+ *
+ * followed by records sorted by prefix, each three varints: prefix
+ * minus the previous record's prefix, new accepts, and seconds of ban
+ * remaining (0 for none). The sequence number goes up by one with each
+ * packet a node sends and starts from the wall clock in nanoseconds, so
+ * it keeps rising across restarts; a packet whose sequence is not above
+ * the last one seen from that peer is dropped as a replay or duplicate.
+ * With -K, an 8-byte SipHash-2-4 of everything before it follows, keyed
+ * from the shared key file; packets without a valid tag are dropped,
+ * and since the tag covers the sequence number a captured packet cannot
+ * be replayed. Without -K anyone who can spoof a peer's address can
+ * inject counts, so received bans are always capped at our own -B and
+ * windows older than the previous second are ignored.
+ */
+
+#define CL_SLOTS 16384
+#define CL_PROBE 32
+#define CL_INTERVAL_MS 100
+#define CL_PACKET 1400
+#define CL_VERSION 2
+#define CL_HEADER 16
+#define CL_MAX_BAN (7 * 86400)
+#define CL_MAC_LEN 8
+#define MAX_PEERS 32
+#define MAX_LOCAL 64
+
+#define CL_KEY(addr) (((addr) >> 8) | 0x01000000)
+
+struct cl_entry {
+	uint32_t key;
+	uint32_t ban_until;
+	uint32_t own_ban;
+	uint32_t ban_sent;
+	/* indexed by window & 1 */
+	uint64_t local[2];
+	uint64_t sent[2];
+	uint64_t remote[2];
+};
+
+struct cl_rec {
+	uint32_t prefix;
+	uint32_t count;
+	uint32_t ban;
+};
+
+static struct cl_entry *cl_table;
+static unsigned cl_limit;
+static unsigned cl_ban = 60;
+static int cl_fd = -1;
+static struct sockaddr_in cl_bind;
+static struct sockaddr_in cl_peers[MAX_PEERS];
+static int cl_npeers;
+static uint64_t cl_peer_seq[MAX_PEERS];
+static uint64_t cl_seq;
+static struct in_addr cl_local[MAX_LOCAL];
+static int cl_nlocal;
+static int cl_keyed;
+static uint64_t cl_k0, cl_k1;
+
+/* window-tagged counters: high half is the second, low half the count */
+static void wc_add(uint64_t *p, uint32_t win, uint32_t n)
+{
+	uint64_t o, v;
+
+	o = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+	do {
+		if ((uint32_t)(o >> 32) == win)
+			v = o + n;
+		else
+			v = ((uint64_t)win << 32) | n;
+	} while (!__atomic_compare_exchange_n(p, &o, v, 0, __ATOMIC_ACQ_REL,
+	                                      __ATOMIC_ACQUIRE));
+}
+
+static uint32_t wc_get(uint64_t *p, uint32_t win)
+{
+	uint64_t o = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+
+	return (uint32_t)(o >> 32) == win ? (uint32_t)o : 0;
+}
+
+#define WC_ADD(pair, win, n) wc_add(&(pair)[(win) & 1], (win), (n))
+#define WC_GET(pair, win) wc_get(&(pair)[(win) & 1], (win))
+
+static void atomic_max32(uint32_t *p, uint32_t v)
+{
+	uint32_t o = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+
+	while (o < v && !__atomic_compare_exchange_n(p, &o, v, 0,
+	                                             __ATOMIC_ACQ_REL,
+	                                             __ATOMIC_ACQUIRE))
+		;
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+static uint64_t siphash(uint64_t k0, uint64_t k1, const unsigned char *in,
+                        size_t len)
+{
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t m, b = (uint64_t)len << 56;
+	size_t i, j;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		for (m = 0, j = 0; j < 8; j++)
+			m |= (uint64_t)in[i + j] << (8 * j);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (j = 0; i + j < len; j++)
+		b |= (uint64_t)in[i + j] << (8 * j);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* derives the packet MAC key from the contents of a shared key file */
+static int cl_load_key(const char *file)
+{
+	unsigned char buf[1024];
+	ssize_t sz;
+	int f;
+
+	if ((f = open(file, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+	sz = read(f, buf, sizeof(buf));
+	close(f);
+
+	if (sz < 16) {
+		fprintf(stderr, "Key file %s must hold at least 16 bytes\n", file);
+		return -1;
+	}
+
+	cl_k0 = siphash(0, 0, buf, sz);
+	cl_k1 = siphash(cl_k0, 1, buf, sz);
+	cl_keyed = 1;
+	memset(buf, 0, sizeof(buf));
+
+	return 0;
+}
+
+static int cl_idle(struct cl_entry *e, uint32_t now)
+{
+	return __atomic_load_n(&e->ban_until, __ATOMIC_ACQUIRE) <= now &&
+	       WC_GET(e->local, now) == 0 && WC_GET(e->remote, now) == 0 &&
+	       WC_GET(e->local, now - 1) == 0 && WC_GET(e->remote, now - 1) == 0;
+}
+
+/*
+ * Idle entries are reused by swapping in the new key; their stale
+ * counters read as zero in the current windows, so nothing else needs
+ * clearing. A process that looked up the old key just before the swap
+ * can still add one count to the new one, which is harmless here.
+ */
+static struct cl_entry *cl_slot(uint32_t key, uint32_t now)
+{
+	uint32_t h = hash32(key);
+	struct cl_entry *e;
+	uint32_t k;
+	int i;
+
+again:
+	for (i = 0; i < CL_PROBE; i++) {
+		e = &cl_table[(h + i) & (CL_SLOTS - 1)];
+		if (__atomic_load_n(&e->key, __ATOMIC_ACQUIRE) == key)
+			return e;
+	}
+
+	for (i = 0; i < CL_PROBE; i++) {
+		e = &cl_table[(h + i) & (CL_SLOTS - 1)];
+		k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+		/* another process may have inserted key since the first pass */
+		if (k == key)
+			return e;
+		if (k != 0 && !cl_idle(e, now))
+			continue;
+		if (__atomic_compare_exchange_n(&e->key, &k, key, 0,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return e;
+		goto again;
+	}
+
+	return NULL;
+}
+
+static int parse_addr(const char *s, struct sockaddr_in *sa)
+{
+	char host[64];
+	const char *colon;
+	int port;
+
+	if (!(colon = strrchr(s, ':')) || colon - s >= sizeof(host))
+		return -1;
+
+	memcpy(host, s, colon - s);
+	host[colon - s] = '\0';
+	port = atoi(colon + 1);
+	if (port < 1 || port > 65535)
+		return -1;
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &sa->sin_addr) != 1)
+		return -1;
+
+	return 0;
+}
+
+/* addresses our sync socket can send from, for telling ourselves apart */
+static void cl_find_local(void)
+{
+	struct ifaddrs *ifs, *ifa;
+
+	if (cl_bind.sin_addr.s_addr != htonl(INADDR_ANY)) {
+		cl_local[cl_nlocal++] = cl_bind.sin_addr;
+		return;
+	}
+
+	if (getifaddrs(&ifs) < 0)
+		return;
+	for (ifa = ifs; ifa && cl_nlocal < MAX_LOCAL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET)
+			cl_local[cl_nlocal++] =
+				((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+	}
+	freeifaddrs(ifs);
+}
+
+static int cl_is_self(const struct sockaddr_in *sa)
+{
+	int i;
+
+	if (sa->sin_port != cl_bind.sin_port)
+		return 0;
+
+	for (i = 0; i < cl_nlocal; i++) {
+		if (cl_local[i].s_addr == sa->sin_addr.s_addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int cl_init(void)
+{
+	struct timespec ts;
+	int i;
+
+	if (!cl_limit && !cl_bind.sin_port)
+		return 0;
+
+	if (!(cl_table = shm_alloc(CL_SLOTS * sizeof(*cl_table))))
+		return -1;
+
+	if (!cl_bind.sin_port)
+		return 0;
+
+	if ((cl_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(cl_fd, (struct sockaddr*)&cl_bind, sizeof(cl_bind)) < 0) {
+		perror("bind");
+		return -1;
+	}
+
+	fcntl(cl_fd, F_SETFL, O_NONBLOCK);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cl_seq = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	cl_find_local();
+	/* a peer list copied to every node names each node itself too */
+	for (i = 0; i < cl_npeers; ) {
+		if (cl_is_self(&cl_peers[i])) {
+			fprintf(stderr, "Ignoring peer %s:%d, which is this node\n",
+			        inet_ntoa(cl_peers[i].sin_addr),
+			        ntohs(cl_peers[i].sin_port));
+			cl_peers[i] = cl_peers[--cl_npeers];
+		} else {
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+/* returns -1 if addr's prefix is banned or over the cluster-wide limit */
+static int cl_admit(uint32_t addr)
+{
+	struct cl_entry *e;
+	struct timespec ts;
+	uint32_t now, until;
+	double seen;
+
+	if (!cl_table)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec;
+	if (!(e = cl_slot(CL_KEY(addr), now)))
+		return 0;
+
+	if (__atomic_load_n(&e->ban_until, __ATOMIC_ACQUIRE) > now)
+		return -1;
+
+	/* the previous second counts for the part of it still in the last 1s */
+	seen = WC_GET(e->local, now) + WC_GET(e->remote, now) +
+	       (WC_GET(e->local, now - 1) + WC_GET(e->remote, now - 1)) *
+	       (1.0 - ts.tv_nsec / 1e9);
+
+	if (cl_limit && seen >= cl_limit) {
+		if (cl_ban) {
+			until = now + cl_ban;
+			atomic_max32(&e->own_ban, until);
+			atomic_max32(&e->ban_until, until);
+			log_line("%u.%u.%u.0/24 banned for %u seconds", addr >> 24,
+			         (addr >> 16) & 0xff, (addr >> 8) & 0xff, cl_ban);
+		}
+		return -1;
+	}
+
+	WC_ADD(e->local, now, 1);
+
+	return 0;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p,
+                                       const unsigned char *end, uint32_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (uint32_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+
+	return NULL;
+}
+
+static int cl_rec_cmp(const void *a, const void *b)
+{
+	const struct cl_rec *x = a, *y = b;
+
+	return x->prefix < y->prefix ? -1 : x->prefix > y->prefix;
+}
+
+/* stamps the next sequence number into buf's header, then signs and sends */
+static void cl_send(unsigned char *buf, size_t len)
+{
+	uint64_t mac;
+	int i;
+
+	cl_seq++;
+	for (i = 0; i < 8; i++)
+		buf[8 + i] = cl_seq >> (56 - 8 * i);
+
+	if (cl_keyed) {
+		mac = siphash(cl_k0, cl_k1, buf, len);
+		for (i = 0; i < CL_MAC_LEN; i++)
+			buf[len++] = mac >> (8 * i);
+	}
+
+	for (i = 0; i < cl_npeers; i++) {
+		sendto(cl_fd, buf, len, 0, (struct sockaddr*)&cl_peers[i],
+		       sizeof(cl_peers[i]));
+	}
+}
+
+/* sends unsent counts for window win, and our bans if win is now */
+static void cl_flush_window(uint32_t win, uint32_t now)
+{
+	static struct cl_rec recs[CL_SLOTS];
+	unsigned char buf[CL_PACKET], *p;
+	struct cl_entry *e;
+	uint32_t l, s, prev;
+	size_t n = 0, i;
+
+	for (i = 0; i < CL_SLOTS; i++) {
+		e = &cl_table[i];
+		if (!__atomic_load_n(&e->key, __ATOMIC_ACQUIRE))
+			continue;
+
+		l = WC_GET(e->local, win);
+		s = WC_GET(e->sent, win);
+		recs[n].count = l > s ? l - s : 0;
+		recs[n].ban = 0;
+		if (win == now && e->own_ban > now && e->ban_sent < now) {
+			recs[n].ban = e->own_ban - now;
+			e->ban_sent = now;
+		}
+		if (!recs[n].count && !recs[n].ban)
+			continue;
+
+		WC_ADD(e->sent, win, recs[n].count);
+		recs[n].prefix = e->key & 0xffffff;
+		n++;
+	}
+
+	if (n == 0)
+		return;
+
+	qsort(recs, n, sizeof(*recs), cl_rec_cmp);
+
+	p = NULL;
+	prev = 0;
+	for (i = 0; i < n; i++) {
+		/* three varints of at most five bytes each, then the MAC */
+		if (p && p + 15 + CL_MAC_LEN > buf + CL_PACKET) {
+			cl_send(buf, p - buf);
+			p = NULL;
+		}
+		if (!p) {
+			memcpy(buf, "PCS", 3);
+			buf[3] = CL_VERSION;
+			buf[4] = win >> 24;
+			buf[5] = win >> 16;
+			buf[6] = win >> 8;
+			buf[7] = win;
+			/* the sequence number is filled in by cl_send() */
+			p = buf + CL_HEADER;
+			prev = 0;
+		}
+		p = put_varint(p, recs[i].prefix - prev);
+		p = put_varint(p, recs[i].count);
+		p = put_varint(p, recs[i].ban);
+		prev = recs[i].prefix;
+	}
+
+	cl_send(buf, p - buf);
+}
+
+static void cl_flush(uint32_t now)
+{
+	/* whatever the last tick of the previous second did not send */
+	cl_flush_window(now - 1, now);
+	cl_flush_window(now, now);
+}
+
+static void cl_recv(void)
+{
+	unsigned char buf[CL_PACKET];
+	const unsigned char *p, *end;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct cl_entry *e;
+	uint32_t now, win, prefix, delta, count, ban;
+	uint64_t mac, seq;
+	ssize_t sz;
+	int i, peer;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		sz = recvfrom(cl_fd, buf, sizeof(buf), 0, (struct sockaddr*)&from,
+		              &fromlen);
+		if (sz < 0)
+			return;
+
+		/* our own counts are already in local */
+		if (cl_is_self(&from))
+			continue;
+
+		for (peer = 0; peer < cl_npeers; peer++) {
+			if (cl_peers[peer].sin_addr.s_addr == from.sin_addr.s_addr &&
+			    cl_peers[peer].sin_port == from.sin_port)
+				break;
+		}
+		if (peer == cl_npeers || sz < CL_HEADER || memcmp(buf, "PCS", 3) ||
+		    buf[3] != CL_VERSION)
+			continue;
+
+		if (cl_keyed) {
+			if (sz < CL_HEADER + CL_MAC_LEN)
+				continue;
+			sz -= CL_MAC_LEN;
+			mac = siphash(cl_k0, cl_k1, buf, sz);
+			for (i = 0; i < CL_MAC_LEN; i++)
+				mac ^= (uint64_t)buf[sz + i] << (8 * i);
+			if (mac)
+				continue;
+		}
+
+		for (seq = 0, i = 0; i < 8; i++)
+			seq = (seq << 8) | buf[8 + i];
+		if (seq <= cl_peer_seq[peer])
+			continue;
+		cl_peer_seq[peer] = seq;
+
+		now = time(NULL);
+		win = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) |
+		      ((uint32_t)buf[6] << 8) | buf[7];
+		/* only the windows the sliding count still looks at matter */
+		if (win != now && win != now - 1)
+			continue;
+
+		prefix = 0;
+		end = buf + sz;
+		for (p = buf + CL_HEADER; p < end; ) {
+			if (!(p = get_varint(p, end, &delta)) ||
+			    !(p = get_varint(p, end, &count)) ||
+			    !(p = get_varint(p, end, &ban)))
+				break;
+			prefix += delta;
+			if (delta >= (1 << 24) || prefix >= (1 << 24))
+				break;
+
+			if (!(e = cl_slot(CL_KEY(prefix << 8), now)))
+				continue;
+			if (count)
+				WC_ADD(e->remote, win, count);
+			/* never let a peer ban for longer than we would */
+			if (ban > cl_ban)
+				ban = cl_ban;
+			if (ban)
+				atomic_max32(&e->ban_until, now + ban);
+		}
+	}
+}
+
+static void cl_tick(void)
+{
+	static struct timespec last;
+	struct timespec ts;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ms = (ts.tv_sec - last.tv_sec) * 1000 +
+	     (ts.tv_nsec - last.tv_nsec) / 1000000;
+	if (ms < CL_INTERVAL_MS)
+		return;
+
+	last = ts;
+	cl_flush(time(NULL));
+}
+
+/*
+ * Distinct clients per UTC hour and day, as HyperLogLog sketches of
+ * source addresses and of their /24s. Each accept hashes the key once
+ * and raises one register, in shared memory so all workers feed the
+ * same sketches. Every interval has two banks, picked by the parity of
+ * the interval number, so the one just finished can still be reported
+ * while the next fills. Whoever first notices a new interval clears
+ * its bank; adds racing with that clear may be lost, which is within
+ * the sketch's error anyway.
+ */
+
+#define HLL_P 12
+#define HLL_M (1 << HLL_P)
+
+struct hll {
+	uint32_t interval;
+	uint8_t reg[HLL_M];
+};
+
+struct hll_period {
+	unsigned secs;
+	const char *name;
+	struct hll addr[2];
+	struct hll net[2];
+};
+
+static struct hll_period *hll_periods;
+static const unsigned hll_secs[] = { 3600, 86400 };
+static const char *hll_names[] = { "hour", "day" };
+#define HLL_NPERIODS (sizeof(hll_secs) / sizeof(*hll_secs))
+
+static uint64_t hash64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static int hll_init(void)
+{
+	size_t i;
+
+	if (!(hll_periods = shm_alloc(HLL_NPERIODS * sizeof(*hll_periods))))
+		return -1;
+
+	for (i = 0; i < HLL_NPERIODS; i++) {
+		hll_periods[i].secs = hll_secs[i];
+		hll_periods[i].name = hll_names[i];
+	}
+
+	return 0;
+}
+
+static void hll_add(struct hll *h, uint32_t interval, uint64_t x)
+{
+	uint32_t cur = __atomic_load_n(&h->interval, __ATOMIC_ACQUIRE);
+	uint8_t *r, o, rank;
+
+	if (cur != interval &&
+	    __atomic_compare_exchange_n(&h->interval, &cur, interval, 0,
+	                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		memset(h->reg, 0, sizeof(h->reg));
+
+	r = &h->reg[x >> (64 - HLL_P)];
+	rank = __builtin_clzll((x << HLL_P) | (1ULL << (HLL_P - 1))) + 1;
+
+	o = __atomic_load_n(r, __ATOMIC_RELAXED);
+	while (o < rank && !__atomic_compare_exchange_n(r, &o, rank, 0,
+	                                                __ATOMIC_RELAXED,
+	                                                __ATOMIC_RELAXED))
+		;
+}
+
+static unsigned long hll_count(const struct hll *h)
+{
+	double sum = 0, est;
+	int i, zeros = 0;
+
+	for (i = 0; i < HLL_M; i++) {
+		sum += ldexp(1.0, -h->reg[i]);
+		if (!h->reg[i])
+			zeros++;
+	}
+
+	est = 0.7213 / (1 + 1.079 / HLL_M) * HLL_M * HLL_M / sum;
+	/* small range correction: linear counting is better here */
+	if (est <= 2.5 * HLL_M && zeros)
+		est = HLL_M * log((double)HLL_M / zeros);
+
+	return est + 0.5;
+}
+
+static void hll_client(uint32_t addr)
+{
+	struct hll_period *p;
+	uint32_t now = time(NULL), interval;
+	uint64_t ha = hash64(addr), hn = hash64(CL_KEY(addr));
+	size_t i;
+
+	if (!hll_periods)
+		return;
+
+	for (i = 0; i < HLL_NPERIODS; i++) {
+		p = &hll_periods[i];
+		interval = now / p->secs;
+		hll_add(&p->addr[interval & 1], interval, ha);
+		hll_add(&p->net[interval & 1], interval, hn);
+	}
+}
+
+static void hll_report(struct hll_period *p, uint32_t interval,
+                       const char *what)
+{
+	struct hll *a = &p->addr[interval & 1], *n = &p->net[interval & 1];
+	char when[64];
+	time_t start = (time_t)interval * p->secs;
+	struct tm *tmp;
+
+	if (a->interval != interval)
+		return;
+
+	/* intervals are whole UTC hours and days, so label them in UTC */
+	if (!(tmp = gmtime(&start)) ||
+	    !strftime(when, sizeof(when), "%Y/%m/%d %H:%M UTC", tmp))
+		strcpy(when, "?");
+
+	log_line("stats: %s %s from %s: %lu addresses, %lu /24s", what,
+	         p->name, when, hll_count(a), hll_count(n));
+}
+
+/* power-of-two histograms: bucket i holds values in [2^(i-1), 2^i) */
+
+#define HIST_BUCKETS 40
 
-static const char *log_prefix(void)
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+static void hist_add(struct hist *h, uint64_t v)
 {
-	static char pfx[512];
-	time_t now;
-	struct tm *tmp;
-	size_t sz;
+	int i = v ? 64 - __builtin_clzll(v) : 0;
 
-	now = time(NULL);
-	if (!(tmp = localtime(&now)))
-		sz = snprintf(pfx, 512, "[----/--/-- --:--:-- +----] ");
-	else
-		sz = strftime(pfx, 512, "[%Y/%m/%d %H:%M:%S %z] ", tmp);
+	if (i >= HIST_BUCKETS)
+		i = HIST_BUCKETS - 1;
 
-	return pfx;
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
 }
 
-static void log_line(const char *fmt, ...)
+/* upper bound of the bucket holding the q'th quantile */
+static uint64_t hist_quantile(const struct hist *h, uint64_t count, double q)
 {
-	char buf[4096];
-	va_list va;
+	uint64_t want = ceil(q * count), seen = 0;
+	int i;
 
-	va_start(va, fmt);
-	vsnprintf(buf, 4096, fmt, va);
-	va_end(va);
+	if (want < 1)
+		want = 1;
 
-	fprintf(log_f, "%s%s\n", log_prefix(), buf);
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+
+	return 1ULL << i;
 }
 
-static void log_flush(void)
+static void hist_report(const char *name, const char *unit,
+                        const struct hist *h)
 {
-	fflush(log_f);
+	uint64_t count = h->count;
+
+	if (!count) {
+		log_line("stats: %s: no samples", name);
+		return;
+	}
+
+	log_line("stats: %s: n=%llu mean=%llu%s p50<%llu p90<%llu p99<%llu "
+	         "p99.9<%llu max<%llu", name, (unsigned long long)count,
+	         (unsigned long long)(h->sum / count), unit,
+	         (unsigned long long)hist_quantile(h, count, 0.5),
+	         (unsigned long long)hist_quantile(h, count, 0.9),
+	         (unsigned long long)hist_quantile(h, count, 0.99),
+	         (unsigned long long)hist_quantile(h, count, 0.999),
+	         (unsigned long long)hist_quantile(h, count, 1.0));
 }
 
-static void log_open(const char *filename)
+/*
+ * Delivery timing (-a N). For one connection in N the child turns on
+ * SO_TIMESTAMPING before writing the policy, then reads the kernel's
+ * TX timestamps for the policy's last byte off the error queue: SND
+ * when it left for the device, ACK when the client acknowledged it.
+ * Both are measured from accept() and kept in microseconds, globally
+ * and per /24 so slow networks stand out in the stats. The per-/24
+ * table is never pruned: once a probe run is full, further /24s only
+ * count towards the global figures and an "untracked" total, so a
+ * long-running server reports the slowest of the /24s it saw first.
+ */
+
+#define DL_TIMEOUT_MS 10000
+#define DL_PREFIXES 4096
+#define DL_PROBE 16
+#define DL_TOP 10
+#define DL_MIN_SAMPLES 5
+
+struct dl_prefix {
+	uint32_t key;
+	uint32_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+struct dl_stats {
+	struct hist snd;
+	struct hist ack;
+	uint64_t timeouts;
+	uint64_t untracked;
+	struct dl_prefix prefix[DL_PREFIXES];
+};
+
+static unsigned dl_sample;
+static struct dl_stats *dl;
+
+static int dl_init(void)
 {
-	if (log_f != NULL) {
-		log_line("tried to open log again");
+	if (!dl_sample)
+		return 0;
+
+	dl = shm_alloc(sizeof(*dl));
+	return dl ? 0 : -1;
+}
+
+static void dl_prefix_add(uint32_t addr, uint64_t us)
+{
+	uint32_t key = CL_KEY(addr), h = hash32(key), k;
+	struct dl_prefix *p;
+	uint64_t o;
+	int i;
+
+	for (i = 0; i < DL_PROBE; i++) {
+		p = &dl->prefix[(h + i) & (DL_PREFIXES - 1)];
+		k = __atomic_load_n(&p->key, __ATOMIC_ACQUIRE);
+		if (k == 0 && __atomic_compare_exchange_n(&p->key, &k, key, 0,
+		                                          __ATOMIC_ACQ_REL,
+		                                          __ATOMIC_ACQUIRE))
+			k = key;
+		if (k == key)
+			break;
+	}
+	if (i == DL_PROBE) {
+		__atomic_fetch_add(&dl->untracked, 1, __ATOMIC_RELAXED);
 		return;
 	}
 
-	log_f = stdout;
+	__atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->sum, us, __ATOMIC_RELAXED);
+	o = __atomic_load_n(&p->max, __ATOMIC_RELAXED);
+	while (o < us && !__atomic_compare_exchange_n(&p->max, &o, us, 0,
+	                                              __ATOMIC_RELAXED,
+	                                              __ATOMIC_RELAXED))
+		;
+}
 
-	if (filename) {
-		log_f = fopen(filename, "a");
+static void dl_enable(int client)
+{
+	int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+	            SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_OPT_ID |
+	            SOF_TIMESTAMPING_OPT_TSONLY;
 
-		if (!log_f) {
-			fprintf(stderr, "Could not open log file %s; using stdout\n",
-			        filename);
-			log_f = stdout;
+	setsockopt(client, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+static uint64_t dl_since(const struct timespec *from, const struct timespec *to)
+{
+	int64_t us = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+	             (to->tv_nsec - from->tv_nsec) / 1000;
+
+	return us < 0 ? 0 : us;
+}
+
+/* waits for the ACK of the policy's last byte; call after send_policy() */
+static void dl_measure(int client, const struct timespec *start, uint32_t addr)
+{
+	char control[512];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct scm_timestamping *tss;
+	struct sock_extended_err *serr;
+	struct pollfd pfd;
+	struct timespec begin, now;
+	uint32_t last = policy_len - 1;
+	int left;
+
+	if (!policy_len)
+		return;
+
+	/* error queue entries show up as POLLERR */
+	pfd.fd = client;
+	pfd.events = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = DL_TIMEOUT_MS - dl_since(&begin, &now) / 1000;
+		if (left <= 0 || poll(&pfd, 1, left) <= 0)
+			break;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(client, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		tss = NULL;
+		serr = NULL;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SCM_TIMESTAMPING)
+				tss = (struct scm_timestamping*)CMSG_DATA(cm);
+			else if (cm->cmsg_level == SOL_IP &&
+			         cm->cmsg_type == IP_RECVERR)
+				serr = (struct sock_extended_err*)CMSG_DATA(cm);
+		}
+
+		if (!tss || !serr || serr->ee_errno != ENOMSG ||
+		    serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+		    serr->ee_data != last)
+			continue;
+
+		if (serr->ee_info == SCM_TSTAMP_SND) {
+			hist_add(&dl->snd, dl_since(start, &tss->ts[0]));
+		} else if (serr->ee_info == SCM_TSTAMP_ACK) {
+			uint64_t us = dl_since(start, &tss->ts[0]);
+
+			hist_add(&dl->ack, us);
+			dl_prefix_add(addr, us);
+			return;
 		}
 	}
 
-	log_line("pcfpd started");
+	__atomic_fetch_add(&dl->timeouts, 1, __ATOMIC_RELAXED);
 }
 
-static void log_close(void)
+static uint64_t dl_mean(const struct dl_prefix *p)
 {
-	fclose(log_f);
+	return p->sum / p->count;
 }
 
-static void log_client(struct sockaddr_in *sa)
+static void dl_report(void)
 {
-	char buf[256];
+	struct dl_prefix *top[DL_TOP], *p;
+	uint64_t mean;
+	int i, j, n = 0;
 
-	if (!log_f)
+	if (!dl)
 		return;
 
-	inet_ntop(AF_INET, &sa->sin_addr, buf, 256);
+	hist_report("delivery to device", "us", &dl->snd);
+	hist_report("delivery acked", "us", &dl->ack);
+	log_line("stats: delivery timeouts: %llu, untracked /24 samples: %llu",
+	         (unsigned long long)dl->timeouts,
+	         (unsigned long long)dl->untracked);
+
+	/* slowest prefixes by mean time to ACK */
+	for (i = 0; i < DL_PREFIXES; i++) {
+		p = &dl->prefix[i];
+		if (!p->key || p->count < DL_MIN_SAMPLES)
+			continue;
+		mean = dl_mean(p);
+		if (n == DL_TOP && dl_mean(top[n - 1]) >= mean)
+			continue;
+		if (n < DL_TOP)
+			n++;
+		for (j = n - 1; j > 0 && dl_mean(top[j - 1]) < mean; j--)
+			top[j] = top[j - 1];
+		top[j] = p;
+	}
 
-	log_line("%s", buf);
+	for (i = 0; i < n; i++) {
+		p = top[i];
+		log_line("stats: delivery acked from %u.%u.%u.0/24: n=%u mean=%lluus "
+		         "max=%lluus", (p->key >> 16) & 0xff, (p->key >> 8) & 0xff,
+		         p->key & 0xff, p->count,
+		         (unsigned long long)dl_mean(p), (unsigned long long)p->max);
+	}
 }
 
-static void log_errno(const char *msg, int e)
+/*
+ * Scheduler accounting (-s N). One connection child in N reports its
+ * own context switches (getrusage) and run-queue wait (schedstat) just
+ * before it exits; both start from zero at fork, so they cover exactly
+ * that request. Each worker also publishes the running totals for its
+ * accept loop about once a second, summed over all of its threads.
+ */
+
+struct sc_worker {
+	pid_t pid;
+	uint64_t requests;
+	uint64_t nvcsw;
+	uint64_t nivcsw;
+	uint64_t run_delay_ns;
+};
+
+struct sc_stats {
+	struct hist delay;
+	struct hist nvcsw;
+	struct hist nivcsw;
+	struct sc_worker worker[MAX_WORKERS];
+};
+
+static unsigned sc_sample;
+static struct sc_stats *sc;
+
+static int sc_init(void)
 {
-	log_line("%s: %s", msg, strerror(e));
-}
+	if (!sc_sample)
+		return 0;
 
-static char policy_data[MAX_POLICY_LEN];
-static size_t policy_len;
+	sc = shm_alloc(sizeof(*sc));
+	return sc ? 0 : -1;
+}
 
-static int read_policy(const char *file)
+/* run-queue wait in ns: the second field of a schedstat file */
+/* returns -1 if path cannot be read, e.g. without CONFIG_SCHEDSTATS */
+static int sc_run_delay(const char *path, uint64_t *delay)
 {
-	int f;
-	ssize_t sz;
+	unsigned long long run, wait;
+	FILE *f;
+	int n;
 
-	if ((f = open(file, O_RDONLY)) < 0) {
-		perror("open");
+	if (!(f = fopen(path, "r")))
 		return -1;
-	}
+	n = fscanf(f, "%llu %llu", &run, &wait);
+	fclose(f);
 
-	policy_len = 0;
+	if (n != 2)
+		return -1;
 
-	while (policy_len < MAX_POLICY_LEN) {
-		sz = read(f, policy_data + policy_len, 65536 - policy_len);
-		if (sz < 0) {
-			perror("read");
-			return -1;
+	*delay = wait;
+	return 0;
+}
+
+static void sc_request(void)
+{
+	struct rusage ru;
+	uint64_t delay;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return;
+
+	hist_add(&sc->nvcsw, ru.ru_nvcsw);
+	hist_add(&sc->nivcsw, ru.ru_nivcsw);
+	/* a missing reading is not a zero wait */
+	if (sc_run_delay("/proc/self/schedstat", &delay) == 0)
+		hist_add(&sc->delay, delay / 1000);
+}
+
+static void sc_tick(int worker, unsigned long served)
+{
+	static struct timespec last;
+	struct sc_worker *w = &sc->worker[worker];
+	struct timespec ts;
+	struct rusage ru;
+	struct dirent *de;
+	char path[300];
+	uint64_t delay = 0, task;
+	int ok = 0;
+	DIR *d;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (ts.tv_sec == last.tv_sec)
+		return;
+	last = ts;
+
+	/* any thread we cannot read makes the sum short; keep the last one */
+	if ((d = opendir("/proc/self/task"))) {
+		ok = 1;
+		while (ok && (de = readdir(d))) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/proc/self/task/%s/schedstat",
+			         de->d_name);
+			if (sc_run_delay(path, &task) < 0)
+				ok = 0;
+			else
+				delay += task;
 		}
-		if (sz == 0)
-			break;
-		policy_len += sz;
+		closedir(d);
 	}
 
-	return 0;
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return;
+
+	/* only this worker writes its slot; readers may see a torn update */
+	w->pid = getpid();
+	w->requests = served;
+	w->nvcsw = ru.ru_nvcsw;
+	w->nivcsw = ru.ru_nivcsw;
+	if (ok)
+		w->run_delay_ns = delay;
+}
+
+static void sc_report(void)
+{
+	struct sc_worker *w;
+	double per;
+	int i;
+
+	if (!sc)
+		return;
+
+	hist_report("request run-queue wait", "us", &sc->delay);
+	hist_report("request voluntary context switches", "", &sc->nvcsw);
+	hist_report("request involuntary context switches", "", &sc->nivcsw);
+
+	for (i = 0; i < MAX_WORKERS; i++) {
+		w = &sc->worker[i];
+		if (!w->pid)
+			continue;
+		per = w->requests ? 1.0 / w->requests : 0;
+		log_line("stats: worker %d (pid %d): %llu requests; per request "
+		         "%.2f voluntary and %.2f involuntary context switches, "
+		         "%.1fus run-queue wait", i, w->pid,
+		         (unsigned long long)w->requests, w->nvcsw * per,
+		         w->nivcsw * per, w->run_delay_ns * per / 1000);
+	}
+}
+
+static void stats_report(void)
+{
+	uint32_t now = time(NULL);
+	size_t i;
+
+	for (i = 0; hll_periods && i < HLL_NPERIODS; i++) {
+		hll_report(&hll_periods[i], now / hll_periods[i].secs,
+		           "unique clients this");
+	}
+
+	dl_report();
+	sc_report();
+}
+
+/* logs each interval once it is over; only the main process calls this */
+static void stats_tick(void)
+{
+	static uint32_t last[HLL_NPERIODS];
+	uint32_t now = time(NULL), interval;
+	size_t i;
+
+	for (i = 0; hll_periods && i < HLL_NPERIODS; i++) {
+		interval = now / hll_periods[i].secs;
+		if (last[i] && last[i] != interval)
+			hll_report(&hll_periods[i], last[i], "unique clients last");
+		last[i] = interval;
+	}
 }
 
 static void send_policy(int client)
@@ -164,6 +1746,39 @@ static void send_policy(int client)
 	}
 }
 
+/*
+ * In transparent mode (-t) one listener answers for whole port ranges
+ * that the firewall steers to it, either with TPROXY, e.g.
+ *
+ *   iptables -t mangle -A PREROUTING -p tcp --dport 6660:7000 \
+ *       -j TPROXY --on-port 843 --tproxy-mark 1
+ *   ip rule add fwmark 1 lookup 100
+ *   ip route add local 0.0.0.0/0 dev lo table 100
+ *
+ * which needs IP_TRANSPARENT (and CAP_NET_ADMIN) on the listener, or
+ * with a plain REDIRECT:
+ *
+ *   iptables -t nat -A PREROUTING -p tcp --dport 6660:7000 \
+ *       -j REDIRECT --to-ports 843
+ *
+ * Either way the port the client asked for is recovered per connection.
+ */
+static int transparent;
+
+static void original_dst(int client, struct sockaddr_in *dst)
+{
+	socklen_t len = sizeof(*dst);
+
+	/* REDIRECT/DNAT rewrote the destination; conntrack remembers it */
+	if (getsockopt(client, SOL_IP, SO_ORIGINAL_DST, dst, &len) == 0)
+		return;
+
+	/* under TPROXY the socket is bound to the original destination */
+	len = sizeof(*dst);
+	if (getsockname(client, (struct sockaddr*)dst, &len) < 0)
+		memset(dst, 0, sizeof(*dst));
+}
+
 static int create_listener(unsigned short port)
 {
 	int listener, c;
@@ -182,12 +1797,16 @@ static int create_listener(unsigned short port)
 	if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &c, sizeof(c)) < 0)
 		perror("warning, setsockopt");
 
+	if (transparent && setsockopt(listener, SOL_IP, IP_TRANSPARENT, &c,
+	                              sizeof(c)) < 0)
+		perror("warning, setsockopt IP_TRANSPARENT");
+
 	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
 		perror("bind");
 		return -1;
 	}
 
-	if (listen(listener, 5) < 0) {
+	if (listen(listener, SOMAXCONN) < 0) {
 		perror("listen");
 		return -1;
 	}
@@ -197,24 +1816,55 @@ static int create_listener(unsigned short port)
 
 static int running;
 
+/*
+ * The handlers only note the signal; the main loop logs it, since the
+ * compressed log takes a lock that the interrupted code may be holding.
+ */
+static volatile sig_atomic_t caught_int, caught_hup, caught_term, caught_usr1;
+
 static void sigint_handler(int sig)
 {
-	log_line("caught SIGINT. stopping...");
+	caught_int = 1;
 	running = 0;
 }
 
 static void sighup_handler(int sig)
 {
 	/* TODO: reload policy file? */
-	log_line("caught SIGHUP. ignoring...");
+	caught_hup = 1;
 }
 
 static void sigterm_handler(int sig)
 {
-	log_line("caught SIGTERM. stopping...");
+	caught_term = 1;
 	running = 0;
 }
 
+static void sigusr1_handler(int sig)
+{
+	caught_usr1 = 1;
+}
+
+static void log_signals(void)
+{
+	if (caught_int) {
+		caught_int = 0;
+		log_line("caught SIGINT. stopping...");
+	}
+	if (caught_hup) {
+		caught_hup = 0;
+		log_line("caught SIGHUP. ignoring...");
+	}
+	if (caught_term) {
+		caught_term = 0;
+		log_line("caught SIGTERM. stopping...");
+	}
+	if (caught_usr1) {
+		caught_usr1 = 0;
+		stats_report();
+	}
+}
+
 static void sigchld_handler(int sig)
 {
 	wait(NULL);
@@ -239,17 +1889,41 @@ static void usage(const char *argv0)
 	fprintf(stderr, " -p PORT     Listen on PORT (default %d)\n", DEFAULT_PORT);
 	fprintf(stderr, " -d          Daemonize (fork to background)\n");
 	fprintf(stderr, " -l FILE     Log requests to FILE (default stdout)\n");
+	fprintf(stderr, " -z          Write the log as gzip members (needs -l)\n");
+	fprintf(stderr, " -t          Transparent mode: answer connections the\n");
+	fprintf(stderr, "             firewall redirects from other ports, and\n");
+	fprintf(stderr, "             log the port each client asked for\n");
+	fprintf(stderr, " -a N        Time delivery until the client ACKs the\n");
+	fprintf(stderr, "             policy for 1 in N connections\n");
+	fprintf(stderr, " -s N        Record context switches and run-queue wait\n");
+	fprintf(stderr, "             for 1 in N connections\n");
+	fprintf(stderr, " -w COUNT    Accept in COUNT worker processes (default 1)\n");
+	fprintf(stderr, " -r RATE     Accept at most RATE connections per second\n");
+	fprintf(stderr, "             from each address, across all workers\n");
+	fprintf(stderr, " -c MAX      Serve at most MAX connections at once per\n");
+	fprintf(stderr, "             address, across all workers\n");
+	fprintf(stderr, " -b LIMIT    Accept at most LIMIT connections per second\n");
+	fprintf(stderr, "             from each /24, across the cluster\n");
+	fprintf(stderr, " -B SECS     Ban a /24 that goes over -b for SECS seconds\n");
+	fprintf(stderr, "             (default %u, 0 to only refuse)\n", cl_ban);
+	fprintf(stderr, " -S ADDR:PORT  Exchange counters and bans on UDP ADDR:PORT\n");
+	fprintf(stderr, " -P ADDR:PORT  Add a cluster peer (may be repeated)\n");
+	fprintf(stderr, " -K FILE     Authenticate peer packets with the key in\n");
+	fprintf(stderr, "             FILE (same file on every node)\n");
 }
 
 int main(int argc, char *argv[])
 {
-	int c, listener;
+	int c, i, listener, worker = 0, timeout;
 	char *policy_file = NULL;
 	char *log_file = NULL;
 	unsigned short port = DEFAULT_PORT;
 	int do_fork = 0;
+	int n_workers = 1;
+	pid_t workers[MAX_WORKERS];
+	unsigned long served = 0;
 
-	while ((c = getopt(argc, argv, "f:p:dl:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "f:p:dl:zta:s:w:r:c:b:B:S:P:K:")) != -1) switch (c) {
 	case 'p':
 		port = atoi(optarg);
 		if (port == 0) {
@@ -274,6 +1948,101 @@ int main(int argc, char *argv[])
 		do_fork = 1;
 		break;
 
+	case 'z':
+		log_gz = 1;
+		break;
+
+	case 't':
+		transparent = 1;
+		break;
+
+	case 's':
+		sc_sample = atoi(optarg);
+		if (sc_sample < 1) {
+			fprintf(stderr, "Invalid sample rate %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'a':
+		dl_sample = atoi(optarg);
+		if (dl_sample < 1) {
+			fprintf(stderr, "Invalid sample rate %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'w':
+		n_workers = atoi(optarg);
+		if (n_workers < 1 || n_workers > MAX_WORKERS) {
+			fprintf(stderr, "Invalid worker count %s (1-%d)\n", optarg,
+			        MAX_WORKERS);
+			return 1;
+		}
+		break;
+
+	case 'r':
+		rl_rate = atoi(optarg);
+		if (rl_rate < 1 || rl_rate > RL_MAX) {
+			fprintf(stderr, "Invalid rate %s (1-%d)\n", optarg, RL_MAX);
+			return 1;
+		}
+		break;
+
+	case 'c':
+		rl_conc = atoi(optarg);
+		if (rl_conc < 1 || rl_conc > RL_MAX) {
+			fprintf(stderr, "Invalid connection limit %s (1-%d)\n", optarg,
+			        RL_MAX);
+			return 1;
+		}
+		break;
+
+	case 'b':
+		cl_limit = atoi(optarg);
+		if (cl_limit < 1) {
+			fprintf(stderr, "Invalid cluster limit %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'B': {
+		char *end;
+		long v = strtol(optarg, &end, 10);
+
+		if (*optarg == '\0' || *end || v < 0 || v > CL_MAX_BAN) {
+			fprintf(stderr, "Invalid ban time %s (0-%d)\n", optarg,
+			        CL_MAX_BAN);
+			return 1;
+		}
+		cl_ban = v;
+		break;
+	}
+
+	case 'K':
+		if (cl_load_key(optarg) < 0)
+			return 1;
+		break;
+
+	case 'S':
+		if (parse_addr(optarg, &cl_bind) < 0) {
+			fprintf(stderr, "Invalid sync address %s\n", optarg);
+			return 1;
+		}
+		break;
+
+	case 'P':
+		if (cl_npeers == MAX_PEERS) {
+			fprintf(stderr, "Too many peers (max %d)\n", MAX_PEERS);
+			return 1;
+		}
+		if (parse_addr(optarg, &cl_peers[cl_npeers]) < 0) {
+			fprintf(stderr, "Invalid peer address %s\n", optarg);
+			return 1;
+		}
+		cl_npeers++;
+		break;
+
 	default:
 		usage(argv[0]);
 		return 1;
@@ -284,6 +2053,7 @@ int main(int argc, char *argv[])
 	sig_handler(SIGINT, sigint_handler);
 	sig_handler(SIGHUP, sighup_handler);
 	sig_handler(SIGTERM, sigterm_handler);
+	sig_handler(SIGUSR1, sigusr1_handler);
 	sig_handler(SIGPIPE, SIG_IGN);
 	sig_handler(SIGCHLD, sigchld_handler);
 
@@ -303,6 +2073,36 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (rl_init() < 0) {
+		fprintf(stderr, "Failed to set up rate limit table\n");
+		return 1;
+	}
+
+	if (cl_npeers && !cl_bind.sin_port) {
+		fprintf(stderr, "Peers given without a sync address -S\n");
+		return 1;
+	}
+
+	if (cl_init() < 0) {
+		fprintf(stderr, "Failed to set up cluster sync\n");
+		return 1;
+	}
+
+	if (hll_init() < 0) {
+		fprintf(stderr, "Failed to set up client counters\n");
+		return 1;
+	}
+
+	if (dl_init() < 0) {
+		fprintf(stderr, "Failed to set up delivery timing\n");
+		return 1;
+	}
+
+	if (sc_init() < 0) {
+		fprintf(stderr, "Failed to set up scheduler accounting\n");
+		return 1;
+	}
+
 	if (do_fork) {
 		pid_t pid;
 
@@ -324,10 +2124,92 @@ int main(int argc, char *argv[])
 		close(2);
 	}
 
+	/* workers[0] is us; the others share the listener and the tables */
+	workers[0] = getpid();
+	log_flush();
+	for (i = 1; i < n_workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			log_errno("fork worker", errno);
+			n_workers = i;
+			break;
+		}
+
+		if (pid == 0) {
+			/* only the main process talks to peers */
+			if (cl_fd >= 0)
+				close(cl_fd);
+			cl_fd = -1;
+			n_workers = 0;
+			worker = i;
+			break;
+		}
+
+		workers[i] = pid;
+	}
+
+	log_start();
+
+	/*
+	 * Workers race for each connection, so the listener must not block
+	 * whoever loses; otherwise the main process could sit in accept()
+	 * while peer updates wait.
+	 */
+	fcntl(listener, F_SETFL, O_NONBLOCK);
+
+	/* wake up for peer sync, stats, scheduler sampling and limit sweeps */
+	if (cl_fd >= 0)
+		timeout = CL_INTERVAL_MS;
+	else if (n_workers || sc || rl_table)
+		timeout = 1000;
+	else
+		timeout = -1;
+
 	for (running = 1; running; ) {
+		struct pollfd pfd[2];
 		struct sockaddr_in sa;
+		struct timespec accepted;
 		socklen_t salen;
-		int client;
+		int client, tracked, timed, sched;
+		uint64_t *slot;
+		pid_t pid;
+
+		pfd[0].fd = listener;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = cl_fd;
+		pfd[1].events = POLLIN;
+
+		log_signals();
+
+		if (cl_fd >= 0)
+			cl_tick();
+
+		/* workers have n_workers == 0; only the main process reports */
+		if (n_workers)
+			stats_tick();
+
+		if (sc)
+			sc_tick(worker, served);
+
+		/* the table is shared, so one process sweeping it is enough */
+		if (rl_table && worker == 0)
+			rl_sweep();
+
+		if (poll(pfd, cl_fd >= 0 ? 2 : 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno("poll", errno);
+			break;
+		}
+
+		if (cl_fd >= 0 && (pfd[1].revents & POLLIN))
+			cl_recv();
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		salen = sizeof(sa);
 		client = accept(listener, (struct sockaddr*)&sa, &salen);
 		if (client < 0) {
 			int e = errno;
@@ -338,14 +2220,52 @@ int main(int argc, char *argv[])
 			}
 			break;
 		}
-		log_client(&sa);
-		if (fork() == 0) {
+		/* before anything else we do for it, which delivery includes */
+		clock_gettime(CLOCK_REALTIME, &accepted);
+		hll_client(ntohl(sa.sin_addr.s_addr));
+		if ((tracked = rl_acquire(ntohl(sa.sin_addr.s_addr), &slot)) < 0 ||
+		    cl_admit(ntohl(sa.sin_addr.s_addr)) < 0) {
+			if (tracked > 0)
+				rl_release(slot);
+			log_refused(&sa);
+			close(client);
+			continue;
+		}
+		if (transparent) {
+			struct sockaddr_in dst;
+
+			original_dst(client, &dst);
+			log_client(&sa, &dst);
+		} else {
+			log_client(&sa, NULL);
+		}
+		served++;
+		timed = dl && served % dl_sample == 0;
+		sched = sc && served % sc_sample == 0;
+		if ((pid = fork()) < 0) {
+			log_errno("fork", errno);
+			if (tracked)
+				rl_release(slot);
+		} else if (pid == 0) {
+			if (timed)
+				dl_enable(client);
 			send_policy(client);
-			exit(0);
+			if (tracked)
+				rl_release(slot);
+			if (sched)
+				sc_request();
+			if (timed)
+				dl_measure(client, &accepted, ntohl(sa.sin_addr.s_addr));
+			/* the parent's log buffers are not ours to flush */
+			_exit(0);
 		}
 		close(client);
 	}
 
+	for (i = 1; i < n_workers; i++)
+		kill(workers[i], SIGTERM);
+
+	log_signals();
 	log_line("pcfpd stopping");
 	log_close();
 